@@ -64,6 +64,20 @@ class _BaseTest(object):
         _mk.set_output_filepath(self._handle, value)
         return self
 
+    def set_record_filepath(self, value):
+        """ Set file path where to record the entries for later replay """
+        _mk.set_record_filepath(self._handle, value)
+        return self
+
+    def set_replay_filepath(self, value, time_compression=1.0):
+        """ Set file path of recorded entries to replay instead of running """
+        # Note: the recorded delays are divided by time_compression, and a
+        # value not greater than zero disables them. The replayed entries are
+        # written into the output file path, if set, while running fails if
+        # the error file path is set, since replay does not produce any log.
+        _mk.set_replay_filepath(self._handle, value, time_compression)
+        return self
+
     def set_options(self, key, value):
         """ Set a specific option of the test (see MeasurementKit manual) """
         _mk.set_options(self._handle, key, value)
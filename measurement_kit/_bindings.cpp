@@ -9,6 +9,13 @@
 #include <measurement_kit/ndt.hpp>
 #include <measurement_kit/ooni.hpp>
 
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
 extern "C" {
 
 using namespace mk;
@@ -18,8 +25,183 @@ using namespace mk;
 // started, i.e. no callback should ever refer to it.
 struct MkCookie {
     Var<NetTest> net_test;
+
+    // Copy of the function passed to the test by `on_entry`, such that we
+    // can wrap it when recording and call it directly when replaying.
+    std::function<void(std::string)> entry_cb;
+
+    // When set, entries are saved into this file along with the time at
+    // which they were produced, such that they can later be replayed.
+    std::string record_filepath;
+
+    // When set, `run` and `run_async` do not perform any network activity
+    // and instead feed the previously recorded entries to `on_entry`.
+    std::string replay_filepath;
+    double replay_time_compression = 1.0;
+
+    // Copies of the paths passed to the test, used when replaying.
+    std::string output_filepath;
+    std::string error_filepath;
+};
+
+// Owns a reference to a Python object and releases it, with the GIL held,
+// when the last copy of the closure sharing it is destroyed.
+struct MkPyRef {
+    PyObject *object = nullptr;
+
+    explicit MkPyRef(PyObject *o) : object(o) { Py_INCREF(object); }
+    MkPyRef(const MkPyRef &) = delete;
+    MkPyRef &operator=(const MkPyRef &) = delete;
+
+    ~MkPyRef() {
+        PyGILState_STATE state = PyGILState_Ensure(); // Acquires the GIL
+        Py_DECREF(object);
+        PyGILState_Release(state); // Releases the GIL
+    }
 };
 
+// A recorded entry is the time in seconds since the beginning of the test
+// at which the entry was produced followed by the entry itself.
+using MkRecord = std::pair<double, report::Entry>;
+
+// State shared by the events scheduled when replaying.
+struct MkReplay {
+    std::vector<MkRecord> records;
+    double time_compression = 1.0;
+    std::function<void(std::string)> entry_cb;
+    Var<std::ofstream> output;
+};
+
+static double mk_elapsed(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin).count();
+}
+
+// Wraps the entry callback such that each entry is also appended to the
+// record file as a single JSON line. Returns false and sets the Python
+// exception if the record file cannot be opened.
+static bool mk_prepare_record(MkCookie *cookie) {
+    if (cookie->record_filepath.empty()) {
+        return true;
+    }
+    Var<std::ofstream> out(new std::ofstream(cookie->record_filepath));
+    if (!out->good()) {
+        PyErr_SetString(PyExc_IOError, "cannot open record file");
+        return false;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::function<void(std::string)> next = cookie->entry_cb;
+    cookie->net_test->on_entry([begin, next, out](std::string entry) {
+        report::Entry record;
+        record["t"] = mk_elapsed(begin);
+        record["entry"] = report::Entry::parse(entry);
+        *out << record.dump() << "\n";
+        out->flush();
+        if (next) {
+            next(entry);
+        }
+    });
+    return true;
+}
+
+// Loads the records saved by `mk_prepare_record` and opens the output file,
+// if any. Returns nullptr and sets the Python exception on failure.
+static Var<MkReplay> mk_prepare_replay(MkCookie *cookie) {
+    if (!cookie->error_filepath.empty()) {
+        PyErr_SetString(PyExc_ValueError,
+                        "error file path not supported when replaying");
+        return nullptr;
+    }
+    Var<MkReplay> replay(new MkReplay);
+    replay->time_compression = cookie->replay_time_compression;
+    replay->entry_cb = cookie->entry_cb;
+    std::ifstream in(cookie->replay_filepath);
+    if (!in.good()) {
+        PyErr_SetString(PyExc_IOError, "cannot open replay file");
+        return nullptr;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        try {
+            report::Entry record = report::Entry::parse(line);
+            double t = record.at("t");
+            report::Entry entry = record.at("entry");
+            replay->records.push_back(MkRecord{t, entry});
+        } catch (const std::exception &) {
+            PyErr_SetString(PyExc_ValueError, "invalid replay file");
+            return nullptr;
+        }
+    }
+    if (!cookie->output_filepath.empty()) {
+        replay->output.reset(new std::ofstream(cookie->output_filepath));
+        if (!replay->output->good()) {
+            PyErr_SetString(PyExc_IOError, "cannot open output file");
+            return nullptr;
+        }
+    }
+    return replay;
+}
+
+// Delivers the record at `index` and schedules the next one after the delay
+// between the two divided by `time_compression`. Chaining the records, rather
+// than scheduling all of them upfront, guarantees that they are delivered in
+// the order in which they were recorded.
+static void mk_replay_next(Var<Reactor> reactor, Var<MkReplay> replay,
+                           size_t index) {
+    if (index >= replay->records.size()) {
+        reactor->break_loop();
+        return;
+    }
+    std::string entry = replay->records[index].second.dump();
+    if (replay->output) {
+        *replay->output << entry << "\n";
+    }
+    if (replay->entry_cb) {
+        replay->entry_cb(entry);
+    }
+    if (index + 1 >= replay->records.size()) {
+        reactor->break_loop();
+        return;
+    }
+    double delay = replay->records[index + 1].first -
+                   replay->records[index].first;
+    auto next = [=]() { mk_replay_next(reactor, replay, index + 1); };
+    if (replay->time_compression > 0.0 && delay > 0.0) {
+        reactor->call_later(delay / replay->time_compression, next);
+    } else {
+        reactor->call_soon(next);
+    }
+}
+
+// Feeds the records to the entry callback, and to the output file if any,
+// from a private reactor and blocks until all of them have been delivered.
+// Each entry is serialized again when it is delivered, so replay exercises
+// the same `dump` and callback code paths of a real run without waiting for
+// the network. The original delays are divided by `time_compression`; a
+// value not greater than zero means that entries are delivered back to back.
+static void mk_replay(Var<MkReplay> replay) {
+    Var<Reactor> reactor = Reactor::make();
+    reactor->loop_with_initial_event([=]() {
+        if (replay->records.empty()) {
+            reactor->break_loop();
+            return;
+        }
+        double delay = replay->records[0].first;
+        auto first = [=]() { mk_replay_next(reactor, replay, 0); };
+        if (replay->time_compression > 0.0 && delay > 0.0) {
+            reactor->call_later(delay / replay->time_compression, first);
+        } else {
+            reactor->call_soon(first);
+        }
+    });
+    if (replay->output) {
+        replay->output->flush();
+    }
+}
+
 static PyObject *meth_library_version(PyObject *, PyObject *args) {
     if (!PyArg_ParseTuple(args, "")) {
         return nullptr;
@@ -142,21 +324,29 @@ static PyObject *meth_on_entry(PyObject *, PyObject *args) {
     MkCookie *cookie = (MkCookie *)pointer;
 
     // Reference the callback to keep it safe and remove the reference when
-    // we enter into the `end` state. It should not happen that `on_entry` is
-    // called again, but for robustness, better to clear it.
-    Py_INCREF(callback);
-    Var<NetTest> net_test = cookie->net_test;
-    cookie->net_test->on_end([callback, net_test]() {
-        net_test->on_entry(nullptr);
-        Py_DECREF(callback);
+    // the last closure using it is destroyed. We clear the test's closure
+    // when we enter into the `end` state: it should not happen that
+    // `on_entry` is called again, but for robustness, better to clear it.
+    // A replayed test never ends, hence `run` and `run_async` clear it.
+    //
+    // Note: the test is referenced weakly, because capturing a Var would
+    // create a cycle keeping the test, its logger and all its callbacks
+    // alive forever when `on_end` is never called to break it.
+    Var<MkPyRef> holder(new MkPyRef(callback));
+    std::weak_ptr<NetTest> weak_net_test = cookie->net_test;
+    cookie->net_test->on_end([weak_net_test]() {
+        std::shared_ptr<NetTest> net_test = weak_net_test.lock();
+        if (net_test) {
+            net_test->on_entry(nullptr);
+        }
     });
 
-    cookie->net_test->on_entry([callback](std::string entry) {
+    cookie->entry_cb = [holder](std::string entry) {
         PyGILState_STATE state = PyGILState_Ensure(); // Acquires the GIL
 
         PyObject *args = Py_BuildValue("(s)", entry.c_str());
         if (args != nullptr) {
-            PyObject *result = PyObject_CallObject(callback, args);
+            PyObject *result = PyObject_CallObject(holder->object, args);
             if (result != nullptr) {
                 Py_DECREF(result);
             } else {
@@ -168,7 +358,8 @@ static PyObject *meth_on_entry(PyObject *, PyObject *args) {
         }
 
         PyGILState_Release(state); // Releases the GIL
-    });
+    };
+    cookie->net_test->on_entry(cookie->entry_cb);
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -194,6 +385,7 @@ static PyObject *meth_set_output_filepath(PyObject *, PyObject *args) {
     }
     MkCookie *cookie = (MkCookie *)pointer;
     cookie->net_test->set_output_filepath(path);
+    cookie->output_filepath = path;
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -206,6 +398,33 @@ static PyObject *meth_set_error_filepath(PyObject *, PyObject *args) {
     }
     MkCookie *cookie = (MkCookie *)pointer;
     cookie->net_test->set_error_filepath(path);
+    cookie->error_filepath = path;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *meth_set_record_filepath(PyObject *, PyObject *args) {
+    const char *path = nullptr;
+    long long pointer = 0LL;
+    if (!PyArg_ParseTuple(args, "Ls", &pointer, &path)) {
+        return nullptr;
+    }
+    MkCookie *cookie = (MkCookie *)pointer;
+    cookie->record_filepath = path;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *meth_set_replay_filepath(PyObject *, PyObject *args) {
+    const char *path = nullptr;
+    long long pointer = 0LL;
+    double time_compression = 1.0;
+    if (!PyArg_ParseTuple(args, "Ls|d", &pointer, &path, &time_compression)) {
+        return nullptr;
+    }
+    MkCookie *cookie = (MkCookie *)pointer;
+    cookie->replay_filepath = path;
+    cookie->replay_time_compression = time_compression;
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -229,6 +448,24 @@ static PyObject *meth_run(PyObject *, PyObject *args) {
         return nullptr;
     }
     MkCookie *cookie = (MkCookie *)pointer;
+    if (!cookie->replay_filepath.empty()) {
+        Var<MkReplay> replay = mk_prepare_replay(cookie);
+        if (!replay) {
+            return nullptr;
+        }
+        cookie->net_test->on_entry(nullptr); // Never ends, see `on_entry`
+        Py_BEGIN_ALLOW_THREADS // Releases the GIL
+
+        mk_replay(replay);
+
+        Py_END_ALLOW_THREADS // Acquires the GIL
+        replay.reset(); // Drops our reference to the entry callback
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (!mk_prepare_record(cookie)) {
+        return nullptr;
+    }
     Py_BEGIN_ALLOW_THREADS // Releases the GIL
 
     cookie->net_test->run();
@@ -249,6 +486,40 @@ static PyObject *meth_run_async(PyObject *, PyObject *args) {
         return nullptr;
     }
     MkCookie *cookie = (MkCookie *)pointer;
+    if (!cookie->replay_filepath.empty()) {
+        Var<MkReplay> replay = mk_prepare_replay(cookie);
+        if (!replay) {
+            return nullptr;
+        }
+        cookie->net_test->on_entry(nullptr); // Never ends, see `on_entry`
+        Py_INCREF(callback);
+        Py_BEGIN_ALLOW_THREADS // Releases the GIL
+
+        std::thread([replay, callback]() mutable {
+            mk_replay(replay);
+
+            PyGILState_STATE state = PyGILState_Ensure(); // Acquires the GIL
+
+            replay.reset(); // Drops our reference to the entry callback
+
+            PyObject *result = PyObject_CallObject(callback, nullptr);
+            if (result != nullptr) {
+                Py_DECREF(result);
+            } else {
+                PyErr_Print();
+            }
+            Py_DECREF(callback);
+
+            PyGILState_Release(state); // Releases the GIL
+        }).detach();
+
+        Py_END_ALLOW_THREADS // Acquires the GIL
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (!mk_prepare_record(cookie)) {
+        return nullptr;
+    }
     Py_INCREF(callback);
     Py_BEGIN_ALLOW_THREADS // Releases the GIL
 
@@ -282,6 +553,8 @@ static PyMethodDef Methods[] = {
     {"set_input_filepath", meth_set_input_filepath, METH_VARARGS, ""},
     {"set_output_filepath", meth_set_output_filepath, METH_VARARGS, ""},
     {"set_error_filepath", meth_set_error_filepath, METH_VARARGS, ""},
+    {"set_record_filepath", meth_set_record_filepath, METH_VARARGS, ""},
+    {"set_replay_filepath", meth_set_replay_filepath, METH_VARARGS, ""},
     {"set_options", meth_set_options, METH_VARARGS, ""},
     {"run", meth_run, METH_VARARGS, ""},
     {"run_async", meth_run_async, METH_VARARGS, ""},
@@ -9,10 +9,93 @@
 
 #include <measurement_kit/ooni.hpp>
 
+#include <openssl/sha.h>
+
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
 namespace mk {
 namespace ooni {
 namespace scriptable {
 
+static std::string sha256_hex(const std::string &data) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)data.data(), data.size(), digest);
+    std::string hex;
+    char buf[3];
+    for (size_t i = 0; i < sizeof (digest); ++i) {
+        snprintf(buf, sizeof (buf), "%02x", digest[i]);
+        hex += buf;
+    }
+    return hex;
+}
+
+// Returns the largest length not greater than `size` at which `data` can be
+// cut without splitting a UTF-8 sequence in half.
+static size_t utf8_prefix_length(const std::string &data, size_t size) {
+    if (size >= data.size()) {
+        return data.size();
+    }
+    while (size > 0 and (data[size] & 0xc0) == 0x80) {
+        --size;
+    }
+    return size;
+}
+
+// Replaces each HTTP response body larger than `max_body_size` with its
+// prefix, recording the original length and SHA256. If `spill_dir` is not
+// empty, the full body is also written into `<spill_dir>/<sha256>.body` and
+// referenced from the response. This keeps the serialized entry, and the
+// copy of it passed to Python, small regardless of the size of the pages.
+// Without a cap, a body that cannot be spilled is left untouched.
+static void cap_response_bodies(Entry &entry, size_t max_body_size,
+                                std::string spill_dir, Var<Logger> logger) {
+    auto requests = entry.find("requests");
+    if (requests == entry.end() or not requests->is_array()) {
+        return;
+    }
+    for (auto &request : *requests) {
+        auto response = request.find("response");
+        if (response == request.end() or not response->is_object()) {
+            continue;
+        }
+        auto body = response->find("body");
+        if (body == response->end() or not body->is_string()) {
+            continue;
+        }
+        const std::string &data = body->get_ref<const std::string &>();
+        if (data.size() <= max_body_size) {
+            continue;
+        }
+        size_t length = data.size();
+        std::string digest = sha256_hex(data);
+        std::string path;
+        if (spill_dir != "") {
+            path = spill_dir + "/" + digest + ".body";
+            std::ofstream out(path, std::ios::binary);
+            out.write(data.data(), data.size());
+            if (not out.good()) {
+                logger->warn("cannot spill body into %s", path.c_str());
+                path = "";
+            }
+        }
+        if (max_body_size == 0 and path == "") {
+            continue;
+        }
+        // Note: `data` is invalid after the body has been replaced
+        std::string prefix = data.substr(0,
+                utf8_prefix_length(data, max_body_size));
+        *body = prefix;
+        if (path != "") {
+            (*response)["body_filepath"] = path;
+        }
+        (*response)["body_length"] = length;
+        (*response)["body_is_truncated"] = true;
+        (*response)["body_sha256"] = digest;
+    }
+}
+
 // Convenience macro used to implement all callbacks below
 #define XX                                                                     \
     [=](Var<Entry> entry) {                                                    \
@@ -53,8 +136,39 @@ void web_connectivity(std::string input, Settings settings,
                       Callback<std::string> callback,
                       Var<RunnerNg> runner,
                       Var<Logger> logger) {
+    // Note: zero means no cap unless spilling, in which case all the
+    // non empty bodies are written to disk and removed from the entry
+    int max_body_size = settings.get("max_response_body_size", 0);
+    std::string spill_dir = settings.get("response_body_spill_dir",
+                                         std::string{});
+    if (max_body_size < 0) {
+        max_body_size = 0;
+    }
+    if (max_body_size == 0 and spill_dir == "") {
+        runner->run([=](Continuation<> complete) {
+            ooni::web_connectivity(input, settings, XX, runner->reactor,
+                                   logger);
+        });
+        return;
+    }
     runner->run([=](Continuation<> complete) {
-        ooni::web_connectivity(input, settings, XX, runner->reactor, logger);
+        ooni::web_connectivity(input, settings, [=](Var<Entry> entry) {
+            if (!entry) {
+                XX(entry);
+                return;
+            }
+            complete([=]() {
+                // Note: hashing and spilling large bodies may take a while,
+                // hence do that, as well as serializing the entry, in a
+                // background thread rather than in the reactor thread that
+                // is shared by all the tests that are running
+                std::thread([=]() {
+                    cap_response_bodies(*entry, max_body_size, spill_dir,
+                                        logger);
+                    callback(entry->dump(4));
+                }).detach();
+            });
+        }, runner->reactor, logger);
     });
 }
 
@@ -21,7 +21,11 @@ def increase_verbosity():
     pybind.increase_verbosity()
 
 def web_connectivity(input_, settings):
-    """ Run OONI WebConnectivity test """
+    """ Run OONI WebConnectivity test; set max_response_body_size to cap
+        the size of the response bodies kept in the entry and set
+        response_body_spill_dir to save the full bodies in there. These
+        two settings are only honoured here, not by the WebConnectivity
+        class, and bodies are hashed and spilled in a background thread """
     done = defer.Deferred()
     def callback(entry):
         reactor.callInThread(
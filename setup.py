@@ -1,7 +1,28 @@
 # Adapted from distutils documentation
 
+import os
+import subprocess
+
 from distutils.core import setup, Extension
 
+def openssl_dirs():
+    """ Returns OpenSSL include and library directories, taken either from
+        the OPENSSL_PREFIX environment variable or from pkg-config """
+    prefix = os.environ.get("OPENSSL_PREFIX")
+    if prefix:
+        return ([os.path.join(prefix, "include")],
+                [os.path.join(prefix, "lib")])
+    try:
+        flags = subprocess.check_output([
+            "pkg-config", "--cflags-only-I", "--libs-only-L", "openssl"
+        ]).decode("utf-8").split()
+    except (OSError, subprocess.CalledProcessError):
+        return [], []
+    return ([flag[2:] for flag in flags if flag.startswith("-I")],
+            [flag[2:] for flag in flags if flag.startswith("-L")])
+
+OPENSSL_INCLUDE_DIRS, OPENSSL_LIBRARY_DIRS = openssl_dirs()
+
 extension = Extension('measurement_kit._bindings',
                       language = "c++",
                       extra_compile_args = ['-std=c++11'],
@@ -23,7 +44,9 @@ Portable C++11 network measurement library (Python bindings)
           Extension("measurement_kit.pybind",
                     language="c++",
                     extra_compile_args=["-std=c++11"],
-                    libraries=["measurement_kit"],
+                    include_dirs=OPENSSL_INCLUDE_DIRS,
+                    library_dirs=OPENSSL_LIBRARY_DIRS,
+                    libraries=["measurement_kit", "crypto"],
                     sources=[
                         "measurement_kit/pybind/module.cpp",
                         "measurement_kit/pybind/compat-0.3.cpp"
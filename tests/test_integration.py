@@ -7,6 +7,13 @@
 # pylint: disable=no-self-use
 
 from __future__ import print_function
+import gc
+import hashlib
+import json
+import os
+import shutil
+import sys
+import tempfile
 import time
 import unittest
 
@@ -134,6 +141,183 @@ class TestIntegrationAsync(unittest.TestCase):
         """ Runs web-connectivity test """
         async_run_of(setup_web_connectivity)
 
+def replay_of(path, time_compression, asynchronous=False):
+    """ Replays the tcp-connect test recorded into path """
+    replayed = []
+    test = setup_tcp_connect()                                                 \
+        .set_replay_filepath(path.encode(), time_compression)                  \
+        .on_entry(replayed.append)
+    if asynchronous:
+        async_run_of(lambda: test)
+    else:
+        test.run()
+    return [json.loads(entry) for entry in replayed]
+
+class TestIntegrationReplay(unittest.TestCase):
+    """ Integration test for record and replay """
+
+    @classmethod
+    def setUpClass(cls):
+        """ Records the tcp-connect test once for all replays """
+        recorded = []
+        fd, cls.path = tempfile.mkstemp()
+        os.close(fd)
+        setup_tcp_connect()                                                    \
+            .set_record_filepath(cls.path.encode())                            \
+            .on_entry(recorded.append)                                         \
+            .run()
+        cls.recorded = [json.loads(entry) for entry in recorded]
+
+    @classmethod
+    def tearDownClass(cls):
+        os.remove(cls.path)
+
+    def test_replay(self):
+        """ Replays tcp-connect back to back """
+        self.assertEqual(self.recorded, replay_of(self.path, 0.0))
+
+    def test_replay_with_time_compression(self):
+        """ Replays tcp-connect with compressed delays """
+        self.assertEqual(self.recorded, replay_of(self.path, 10.0))
+
+    def test_replay_async(self):
+        """ Replays tcp-connect using the async wrapper """
+        self.assertEqual(self.recorded, replay_of(self.path, 0.0, True))
+
+REPLAY_ENTRIES = [{"input": "a"}, {"input": "b"}]
+
+def write_replay_file(lines):
+    """ Writes lines into a temporary replay file and returns its path """
+    fd, path = tempfile.mkstemp()
+    with os.fdopen(fd, "w") as filep:
+        for line in lines:
+            filep.write(line + "\n")
+    return path
+
+class TestReplayFile(unittest.TestCase):
+    """ Test for replay using hand-written record files """
+
+    def setUp(self):
+        self.path = write_replay_file([
+            json.dumps({"t": 0.0, "entry": REPLAY_ENTRIES[0]}),
+            json.dumps({"t": 2.0, "entry": REPLAY_ENTRIES[1]}),
+        ])
+
+    def tearDown(self):
+        os.remove(self.path)
+
+    def test_output_filepath(self):
+        """ Checks that replayed entries are written into the output file """
+        fd, output = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            setup_tcp_connect()                                                \
+                .set_replay_filepath(self.path.encode(), 0.0)                  \
+                .set_output_filepath(output.encode())                          \
+                .run()
+            with open(output) as filep:
+                entries = [json.loads(line) for line in filep]
+        finally:
+            os.remove(output)
+        self.assertEqual(REPLAY_ENTRIES, entries)
+
+    def test_error_filepath(self):
+        """ Checks that replay fails if the error file path is set """
+        # pylint: disable=no-member,protected-access
+        from measurement_kit import _bindings as _mk
+        test = setup_tcp_connect().set_replay_filepath(self.path.encode())
+        _mk.set_error_filepath(test._handle, b"error.log")
+        with self.assertRaises(ValueError):
+            test.run()
+        # pylint: enable=no-member,protected-access
+
+    def test_invalid_lines(self):
+        """ Checks that malformed and incomplete lines are rejected """
+        for line in ["{", json.dumps({"entry": REPLAY_ENTRIES[0]}),
+                     json.dumps({"t": 0.0})]:
+            path = write_replay_file([line])
+            try:
+                test = setup_tcp_connect().set_replay_filepath(path.encode())
+                with self.assertRaises(ValueError):
+                    test.run()
+            finally:
+                os.remove(path)
+
+    def test_time_compression(self):
+        """ Checks that delays are applied and scaled """
+        begin = time.time()
+        self.assertEqual(REPLAY_ENTRIES, replay_of(self.path, 4.0))
+        elapsed = time.time() - begin
+        self.assertGreaterEqual(elapsed, 0.45)
+        self.assertLess(elapsed, 1.5)
+        begin = time.time()
+        self.assertEqual(REPLAY_ENTRIES, replay_of(self.path, 0.0))
+        self.assertLess(time.time() - begin, 0.45)
+
+    def test_callback_released(self):
+        """ Checks that on_entry's callback is released after replay """
+        def callback(_):
+            """ Function called for every replayed entry """
+        refcount = sys.getrefcount(callback)
+        test = setup_tcp_connect()                                             \
+            .set_replay_filepath(self.path.encode(), 0.0)                      \
+            .on_entry(callback)
+        test.run()
+        del test
+        gc.collect()
+        self.assertEqual(refcount, sys.getrefcount(callback))
+
+def pybind_web_connectivity(settings):
+    """ Runs web-connectivity using the pybind module and returns the
+        response of every request with a string body """
+    from measurement_kit import pybind
+    entries = []
+    settings = dict(settings, nameserver="8.8.8.8:53")
+    pybind.web_connectivity("http://archive.org", settings, entries.append)
+    while not entries:
+        time.sleep(1.0)
+    responses = []
+    for request in json.loads(entries[0]).get("requests", []):
+        response = request.get("response") or {}
+        if isinstance(response.get("body"), type(u"")):
+            responses.append(response)
+    return responses
+
+class TestIntegrationBodyCap(unittest.TestCase):
+    """ Integration test for capping and spilling response bodies """
+
+    def test_max_response_body_size(self):
+        """ Checks that large bodies are truncated and hashed """
+        responses = pybind_web_connectivity({
+            "max_response_body_size": "16",
+        })
+        truncated = [r for r in responses if r.get("body_is_truncated")]
+        self.assertTrue(truncated)
+        for response in truncated:
+            self.assertLessEqual(len(response["body"].encode("utf-8")), 16)
+            self.assertGreater(response["body_length"], 16)
+            self.assertEqual(len(response["body_sha256"]), 64)
+            self.assertNotIn("body_filepath", response)
+
+    def test_response_body_spill_dir(self):
+        """ Checks that bodies are spilled into the specified directory """
+        spill_dir = tempfile.mkdtemp()
+        try:
+            responses = pybind_web_connectivity({
+                "response_body_spill_dir": spill_dir,
+            })
+            spilled = [r for r in responses if r.get("body_is_truncated")]
+            self.assertTrue(spilled)
+            for response in spilled:
+                self.assertEqual(response["body"], "")
+                with open(response["body_filepath"], "rb") as filep:
+                    data = filep.read()
+                self.assertEqual(len(data), response["body_length"])
+                self.assertEqual(hashlib.sha256(data).hexdigest(),
+                                 response["body_sha256"])
+        finally:
+            shutil.rmtree(spill_dir)
+
 def deferred_run_of(creator):
     """ Executes deferred run of the creator function """
     return creator().run_deferred()